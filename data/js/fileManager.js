@@ -264,13 +264,13 @@ function uploadFile(e) {
         }
 
         const file = files[uploadedCount];
-        const formData = new FormData();
-        formData.append('file', file);
-
-        const url = '/upload?path=' + encodeURIComponent(state.currentPath);
+        const targetPath = (state.currentPath + '/' + file.name).split('/').filter(Boolean);
+        const url = '/files/' + targetPath.map(encodeURIComponent).join('/');
 
         const xhr = new XMLHttpRequest();
-        xhr.open('POST', url);
+        xhr.open('PUT', url);
+        // Keeps the server from treating text bodies as form parameters
+        xhr.setRequestHeader('Content-Type', 'application/octet-stream');
 
         console.log(`Uploading (${uploadedCount + 1}/${totalFiles}):`, file.name,
             "to path:", state.currentPath);
@@ -289,7 +289,7 @@ function uploadFile(e) {
         };
 
         xhr.onload = function () {
-            if (xhr.status === 200) {
+            if (xhr.status === 200 || xhr.status === 201) {
                 console.log(`Uploaded: ${file.name}`);
                 uploadedCount++;
 
@@ -309,7 +309,7 @@ function uploadFile(e) {
             setTimeout(uploadNextFile, 100);
         };
 
-        xhr.send(formData);
+        xhr.send(file);
     }
 
     uploadNextFile();
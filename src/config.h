@@ -14,5 +14,16 @@ static IPAddress subnet(255, 255, 255, 0);
 #define SD_MOSI 11
 #define SD_CS 10
 #define SERVER_PORT 80
+#define UPLOAD_BUFFER_SIZE 16384
+
+// SD I/O scheduling: share of bytes bulk transfers may use while interactive requests are active
+#define IO_BULK_SHARE_PERCENT 25
+#define IO_BULK_SLICE_BYTES 8192
+#define IO_BULK_TRICKLE_BYTES 512
+#define IO_INTERACTIVE_HOLD_MS 250
+// One slow interactive response stops throttling bulk work after this long
+#define IO_INTERACTIVE_MAX_MS 2000
+// Upload bytes left unacknowledged per connection, clamped to half the lwIP receive window
+#define IO_UPLOAD_MAX_DEFER_BYTES 4096
 
 #endif
\ No newline at end of file
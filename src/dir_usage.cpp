@@ -0,0 +1,492 @@
+#include "dir_usage.h"
+#include "SD.h"
+#include "file_utils.h"
+#include "io_scheduler.h"
+#include <map>
+#include <vector>
+
+typedef std::map<String, DirUsage> UsageIndex;
+
+enum ChangeKind {
+    CHANGE_FILE,
+    CHANGE_ADD_FOLDER,
+    CHANGE_REMOVE_FOLDER,
+    CHANGE_MOVE_FOLDER
+};
+
+// An index update made while a scan was running, replayed onto the scan's result.
+struct UsageChange {
+    uint32_t seq;
+    ChangeKind kind;
+    String dir;   // folder whose own listing changed
+    String path;  // folder added, removed or moved
+    String to;    // move destination
+    int64_t bytes;
+    int32_t files;
+};
+
+// Result of one walk of the card, with the change number seen when each folder was listed
+struct ScanResult {
+    UsageIndex index;
+    std::map<String, uint32_t> listedAt;
+};
+
+static UsageIndex usageIndex;
+static SemaphoreHandle_t usageMutex = nullptr;
+// Held by writers from their SD change through the index update, and by the scan
+// while it lists one folder, so every listing sees a change entirely or not at all
+static SemaphoreHandle_t writeGate = nullptr;
+static bool indexReady = false;
+static bool scanRunning = false;
+static bool rescanRequested = false;
+static uint32_t changeSeq = 0;
+static std::vector<UsageChange> journal;
+
+static void scanTask(void *);
+
+// FAT names are case-insensitive, so index keys are lower-cased.
+static String normalizeDir(const String& path) {
+    String p = sanitizePath(path);
+    while (p.length() > 1 && p.endsWith("/")) {
+        p.remove(p.length() - 1);
+    }
+    p.toLowerCase();
+    return p;
+}
+
+static String parentOf(const String& path) {
+    int lastSlash = path.lastIndexOf('/');
+    if (lastSlash <= 0) return "/";
+    return path.substring(0, lastSlash);
+}
+
+static String joinPath(const String& dir, const char *name) {
+    return dir == "/" ? "/" + String(name) : dir + "/" + String(name);
+}
+
+static bool inSubtree(const String& key, const String& root) {
+    return key == root || key.startsWith(root + "/");
+}
+
+template <typename T>
+static void eraseSubtree(std::map<String, T>& map, const String& root) {
+    for (auto i = map.begin(); i != map.end();) {
+        if (inSubtree(i->first, root)) {
+            i = map.erase(i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+template <typename T>
+static void renameSubtree(std::map<String, T>& map, const String& from, const String& to) {
+    std::vector<std::pair<String, T>> moved;
+    for (auto i = map.begin(); i != map.end();) {
+        if (inSubtree(i->first, from)) {
+            moved.push_back({to + i->first.substring(from.length()), i->second});
+            i = map.erase(i);
+        } else {
+            ++i;
+        }
+    }
+    for (const auto &entry : moved) {
+        map[entry.first] = entry.second;
+    }
+}
+
+// False when dir or one of its ancestors is not indexed.
+static bool ancestorsIndexed(const UsageIndex& index, const String& dir) {
+    String p = dir;
+    while (true) {
+        if (index.find(p) == index.end()) return false;
+        if (p == "/") return true;
+        p = parentOf(p);
+    }
+}
+
+// Caller has checked ancestorsIndexed(index, dir). Walks from dir up to the root.
+static void applyToAncestors(UsageIndex& index, const String& dir, int64_t bytes, int32_t files, int32_t dirs) {
+    String p = dir;
+    while (true) {
+        DirUsage &u = index.find(p)->second;
+        int64_t nextBytes = (int64_t)u.bytes + bytes;
+        int64_t nextFiles = (int64_t)u.files + files;
+        int64_t nextDirs = (int64_t)u.dirs + dirs;
+        u.bytes = nextBytes < 0 ? 0 : nextBytes;
+        u.files = nextFiles < 0 ? 0 : nextFiles;
+        u.dirs = nextDirs < 0 ? 0 : nextDirs;
+        if (p == "/") break;
+        p = parentOf(p);
+    }
+}
+
+// The index operations below return false when the index does not know a path they need.
+
+static bool applyFileChange(UsageIndex& index, const String& dir, int64_t bytes, int32_t files) {
+    if (!ancestorsIndexed(index, dir)) return false;
+    applyToAncestors(index, dir, bytes, files, 0);
+    return true;
+}
+
+static bool addFolder(UsageIndex& index, const String& key) {
+    if (key == "/" || index.find(key) != index.end()) return true;
+    if (!ancestorsIndexed(index, parentOf(key))) return false;
+    index[key] = DirUsage();
+    applyToAncestors(index, parentOf(key), 0, 0, 1);
+    return true;
+}
+
+// A folder missing from the index counts as empty unless mustExist is set.
+static bool removeFolder(UsageIndex& index, const String& key, bool mustExist) {
+    if (key == "/" || !ancestorsIndexed(index, parentOf(key))) return false;
+    auto it = index.find(key);
+    if (it == index.end() && mustExist) return false;
+    DirUsage removed = it != index.end() ? it->second : DirUsage();
+    eraseSubtree(index, key);
+    applyToAncestors(index, parentOf(key), -(int64_t)removed.bytes,
+                     -(int32_t)removed.files, -(int32_t)removed.dirs - 1);
+    return true;
+}
+
+static bool moveFolder(UsageIndex& index, const String& from, const String& to) {
+    auto it = index.find(from);
+    if (it == index.end() || !ancestorsIndexed(index, parentOf(from)) ||
+        !ancestorsIndexed(index, parentOf(to))) {
+        return false;
+    }
+    DirUsage moved = it->second;
+    renameSubtree(index, from, to);
+    applyToAncestors(index, parentOf(from), -(int64_t)moved.bytes,
+                     -(int32_t)moved.files, -(int32_t)moved.dirs - 1);
+    applyToAncestors(index, parentOf(to), moved.bytes, moved.files, moved.dirs + 1);
+    return true;
+}
+
+// Caller holds usageMutex.
+static void startScanLocked() {
+    if (scanRunning) {
+        rescanRequested = true;
+        return;
+    }
+    scanRunning = true;
+    rescanRequested = false;
+    journal.clear();
+    xTaskCreate(scanTask, "du_scan", 8192, NULL, tskIDLE_PRIORITY + 1, NULL);
+}
+
+// Caller holds usageMutex. Numbers the change and keeps it for a running scan to replay.
+static void recordChange(ChangeKind kind, const String& dir, const String& path,
+                         const String& to, int64_t bytes, int32_t files) {
+    changeSeq++;
+    if (scanRunning) {
+        journal.push_back({changeSeq, kind, dir, path, to, bytes, files});
+    }
+}
+
+// Caller holds usageMutex. A live index that missed a path keeps being served while a rescan runs.
+static void checkApplied(bool applied) {
+    if (!applied) {
+        Serial.println("Usage index out of sync, rescanning");
+        startScanLocked();
+    }
+}
+
+// PUT temp files (".<name>.<seq>.part") and replaced copies (".<name>.<seq>.old").
+// Matches the ".<name>.<seq>.part" / ".<name>.<seq>.old" files a PUT writes
+// next to its target and fills in <name>.
+static bool parseTransferTemp(const String& name, String& original) {
+    int suffix = name.endsWith(".part") ? 5 : name.endsWith(".old") ? 4 : 0;
+    if (!suffix || !name.startsWith(".")) return false;
+    String stem = name.substring(0, name.length() - suffix);
+    int dot = stem.lastIndexOf('.');
+    if (dot <= 1 || dot == (int)stem.length() - 1) return false;
+    for (unsigned i = dot + 1; i < stem.length(); i++) {
+        if (!isDigit(stem.charAt(i))) return false;
+    }
+    original = stem.substring(1, dot);
+    return true;
+}
+
+// A ".part" is an unfinished upload and is dropped. A ".old" is the previous
+// copy of a replaced file; it goes back into place if the new one never
+// arrived. Returns true if the file was restored.
+static bool recoverTransferTemp(const String& dirPath, const String& tempName,
+                                const String& original) {
+    String tempPath = joinPath(dirPath, tempName.c_str());
+    String target = joinPath(dirPath, original.c_str());
+    if (tempName.endsWith(".old") && !SD.exists(target)) {
+        if (SD.rename(tempPath, target)) {
+            Serial.printf("Restored interrupted upload target: %s\n", target.c_str());
+            return true;
+        }
+        Serial.printf("Failed to restore %s\n", tempPath.c_str());
+        return false;
+    }
+    Serial.printf("Removing stale upload file: %s\n", tempPath.c_str());
+    SD.remove(tempPath);
+    return false;
+}
+
+static DirUsage scanDir(const String& path, ScanResult& scan) {
+    DirUsage usage;
+    std::vector<String> subdirs;
+    String key = normalizeDir(path);
+
+    ioWaitForIdle();
+    xSemaphoreTakeRecursive(writeGate, portMAX_DELAY);
+    File dir = SD.open(path);
+    bool opened = dir && dir.isDirectory();
+    if (opened) {
+        xSemaphoreTake(usageMutex, portMAX_DELAY);
+        scan.listedAt[key] = changeSeq;
+        xSemaphoreGive(usageMutex);
+
+        // Holding the gate means no PUT is in progress, so any temp file left
+        // here is from an upload cut off by a reset or a failed replace
+        struct StaleTemp { String name; String original; uint64_t size; };
+        std::vector<StaleTemp> stale;
+        File entry = dir.openNextFile();
+        while (entry) {
+            String original;
+            if (entry.isDirectory()) {
+                subdirs.push_back(joinPath(path, entry.name()));
+            } else if (parseTransferTemp(entry.name(), original)) {
+                stale.push_back({entry.name(), original, entry.size()});
+            } else {
+                usage.bytes += entry.size();
+                usage.files++;
+            }
+            entry.close();
+            entry = dir.openNextFile();
+        }
+        dir.close();
+
+        for (const StaleTemp &temp : stale) {
+            if (recoverTransferTemp(path, temp.name, temp.original)) {
+                usage.bytes += temp.size;
+                usage.files++;
+            }
+        }
+    } else if (dir) {
+        dir.close();
+    }
+    xSemaphoreGiveRecursive(writeGate);
+
+    if (!opened) return usage;
+
+    for (const String &subdir : subdirs) {
+        DirUsage child = scanDir(subdir, scan);
+        usage.bytes += child.bytes;
+        usage.files += child.files;
+        usage.dirs += child.dirs + 1;
+    }
+
+    scan.index[key] = usage;
+    return usage;
+}
+
+// 1 when dir was listed before the change (the scan missed it), 0 when after, -1 when never listed.
+static int listedBefore(const ScanResult& scan, const String& dir, uint32_t seq) {
+    auto it = scan.listedAt.find(dir);
+    if (it == scan.listedAt.end()) return -1;
+    return it->second < seq ? 1 : 0;
+}
+
+// True when every folder of the subtree was listed, and listed before change seq.
+static bool subtreeListedBefore(const ScanResult& scan, const String& root, uint32_t seq) {
+    auto it = scan.index.find(root);
+    if (it == scan.index.end()) return false;
+    uint32_t folders = 0;
+    for (const auto &entry : scan.listedAt) {
+        if (!inSubtree(entry.first, root)) continue;
+        if (entry.second >= seq) return false;
+        folders++;
+    }
+    return folders == it->second.dirs + 1;
+}
+
+// Caller holds usageMutex. Brings a finished scan up to date with the changes journaled
+// while it ran. False when a change cannot be placed and the card has to be walked again.
+static bool replayJournal(ScanResult& scan) {
+    for (const UsageChange &change : journal) {
+        int missed = listedBefore(scan, change.dir, change.seq);
+        if (missed < 0) return false;
+
+        switch (change.kind) {
+        case CHANGE_FILE:
+            if (missed && !applyFileChange(scan.index, change.dir, change.bytes, change.files)) return false;
+            break;
+        case CHANGE_ADD_FOLDER:
+            if (missed) {
+                if (!addFolder(scan.index, change.path)) return false;
+                scan.listedAt[change.path] = change.seq;
+            }
+            break;
+        case CHANGE_REMOVE_FOLDER:
+            if (missed) {
+                if (!removeFolder(scan.index, change.path, false)) return false;
+                eraseSubtree(scan.listedAt, change.path);
+            }
+            break;
+        case CHANGE_MOVE_FOLDER: {
+            int dstMissed = listedBefore(scan, parentOf(change.to), change.seq);
+            if (dstMissed < 0) return false;
+            bool countedAtSrc = missed;
+            bool countedAtDst = !dstMissed;
+            if (countedAtSrc && countedAtDst) {
+                if (!removeFolder(scan.index, change.path, false)) return false;
+                eraseSubtree(scan.listedAt, change.path);
+            } else if (countedAtSrc) {
+                if (!subtreeListedBefore(scan, change.path, change.seq)) return false;
+                if (!moveFolder(scan.index, change.path, change.to)) return false;
+                renameSubtree(scan.listedAt, change.path, change.to);
+            } else if (!countedAtDst) {
+                return false;
+            }
+            break;
+        }
+        }
+    }
+    return true;
+}
+
+static void scanTask(void *) {
+    bool done = false;
+    while (!done) {
+        unsigned long started = millis();
+        ScanResult scan;
+        DirUsage root = scanDir("/", scan);
+
+        xSemaphoreTake(usageMutex, portMAX_DELAY);
+        bool replayed = replayJournal(scan);
+        journal.clear();
+        if (replayed) {
+            usageIndex.swap(scan.index);
+            indexReady = true;
+        }
+        done = replayed && !rescanRequested;
+        rescanRequested = false;
+        if (done) {
+            scanRunning = false;
+        }
+        xSemaphoreGive(usageMutex);
+
+        if (replayed) {
+            Serial.printf("Usage scan complete: %llu bytes, %u files, %u folders in %lu ms\n",
+                          root.bytes, (unsigned)root.files, (unsigned)root.dirs, millis() - started);
+        }
+        if (!done) {
+            Serial.println("Usage scan outdated by a change, rescanning");
+        }
+    }
+    vTaskDelete(NULL);
+}
+
+void startDirUsageScan() {
+    if (!usageMutex) {
+        usageMutex = xSemaphoreCreateMutex();
+        writeGate = xSemaphoreCreateRecursiveMutex();
+    }
+
+    xSemaphoreTake(usageMutex, portMAX_DELAY);
+    startScanLocked();
+    xSemaphoreGive(usageMutex);
+}
+
+bool isDirUsageReady() {
+    if (!usageMutex) return false;
+    xSemaphoreTake(usageMutex, portMAX_DELAY);
+    bool ready = indexReady;
+    xSemaphoreGive(usageMutex);
+    return ready;
+}
+
+bool getDirUsage(const String& path, DirUsage& out) {
+    if (!usageMutex) return false;
+    String key = normalizeDir(path);
+    xSemaphoreTake(usageMutex, portMAX_DELAY);
+    bool found = false;
+    if (indexReady) {
+        auto it = usageIndex.find(key);
+        if (it != usageIndex.end()) {
+            out = it->second;
+            found = true;
+        }
+    }
+    xSemaphoreGive(usageMutex);
+    return found;
+}
+
+void dirUsageBeginWrite() {
+    if (!writeGate) return;
+    xSemaphoreTakeRecursive(writeGate, portMAX_DELAY);
+}
+
+void dirUsageEndWrite() {
+    if (!writeGate) return;
+    xSemaphoreGiveRecursive(writeGate);
+}
+
+void dirUsageApplyFile(const String& filePath, int64_t bytesDelta, int32_t filesDelta) {
+    if (!usageMutex) return;
+    String dir = parentOf(normalizeDir(filePath));
+    xSemaphoreTake(usageMutex, portMAX_DELAY);
+    recordChange(CHANGE_FILE, dir, "", "", bytesDelta, filesDelta);
+    if (indexReady) {
+        checkApplied(applyFileChange(usageIndex, dir, bytesDelta, filesDelta));
+    }
+    xSemaphoreGive(usageMutex);
+}
+
+void dirUsageAddFolder(const String& path) {
+    if (!usageMutex) return;
+    String key = normalizeDir(path);
+    if (key == "/") return;
+    xSemaphoreTake(usageMutex, portMAX_DELAY);
+    recordChange(CHANGE_ADD_FOLDER, parentOf(key), key, "", 0, 0);
+    if (indexReady) {
+        checkApplied(addFolder(usageIndex, key));
+    }
+    xSemaphoreGive(usageMutex);
+}
+
+void dirUsageRemoveFolder(const String& path) {
+    if (!usageMutex) return;
+    String key = normalizeDir(path);
+    if (key == "/") return;
+    xSemaphoreTake(usageMutex, portMAX_DELAY);
+    recordChange(CHANGE_REMOVE_FOLDER, parentOf(key), key, "", 0, 0);
+    if (indexReady) {
+        checkApplied(removeFolder(usageIndex, key, true));
+    }
+    xSemaphoreGive(usageMutex);
+}
+
+void dirUsageMove(const String& src, const String& dst, bool isDir, uint64_t fileSize) {
+    if (!usageMutex) return;
+    String from = normalizeDir(src);
+    String to = normalizeDir(dst);
+    xSemaphoreTake(usageMutex, portMAX_DELAY);
+
+    if (!isDir) {
+        recordChange(CHANGE_FILE, parentOf(from), "", "", -(int64_t)fileSize, -1);
+        recordChange(CHANGE_FILE, parentOf(to), "", "", fileSize, 1);
+        if (indexReady) {
+            bool known = ancestorsIndexed(usageIndex, parentOf(from)) &&
+                         ancestorsIndexed(usageIndex, parentOf(to));
+            if (known) {
+                applyToAncestors(usageIndex, parentOf(from), -(int64_t)fileSize, -1, 0);
+                applyToAncestors(usageIndex, parentOf(to), fileSize, 1, 0);
+            }
+            checkApplied(known);
+        }
+    } else {
+        recordChange(CHANGE_MOVE_FOLDER, parentOf(from), from, to, 0, 0);
+        if (indexReady) {
+            checkApplied(moveFolder(usageIndex, from, to));
+        }
+    }
+
+    xSemaphoreGive(usageMutex);
+}
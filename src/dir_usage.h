@@ -0,0 +1,26 @@
+#ifndef DIR_USAGE_H
+#define DIR_USAGE_H
+
+#include <Arduino.h>
+
+// Aggregate usage of a directory subtree (the directory itself not counted in dirs).
+struct DirUsage {
+    uint64_t bytes = 0;
+    uint32_t files = 0;
+    uint32_t dirs = 0;
+};
+
+void startDirUsageScan();
+bool isDirUsageReady();
+bool getDirUsage(const String& path, DirUsage& out);
+
+// Bracket an SD change and its dirUsage* update. A running scan never lists a
+// folder in between, so it sees the change either entirely or not at all.
+void dirUsageBeginWrite();
+void dirUsageEndWrite();
+void dirUsageApplyFile(const String& filePath, int64_t bytesDelta, int32_t filesDelta);
+void dirUsageAddFolder(const String& path);
+void dirUsageRemoveFolder(const String& path);
+void dirUsageMove(const String& src, const String& dst, bool isDir, uint64_t fileSize);
+
+#endif
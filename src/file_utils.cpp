@@ -1,4 +1,5 @@
 #include "file_utils.h"
+#include "dir_usage.h"
 
 String sanitizePath(String path) {
     path.replace("\\", "/");
@@ -32,8 +33,8 @@ void createPath(String path) {
         int end = path.indexOf('/', start + 1);
         if (end == -1) break;
         current = path.substring(0, end);
-        if (!SD.exists(current)) {
-            SD.mkdir(current);
+        if (!SD.exists(current) && SD.mkdir(current)) {
+            dirUsageAddFolder(current);
         }
         start = end;
     }
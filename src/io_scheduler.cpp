@@ -0,0 +1,168 @@
+#include "io_scheduler.h"
+#include "config.h"
+#include <AsyncTCP.h>
+#include <lwip/opt.h>
+#include <algorithm>
+#include <vector>
+
+static portMUX_TYPE ioMux = portMUX_INITIALIZER_UNLOCKED;
+// Start times of interactive work in flight, one slot per live InteractiveIo
+static const int MAX_INTERACTIVE_TICKETS = 16;
+static bool ticketUsed[MAX_INTERACTIVE_TICKETS];
+static unsigned long ticketStartMs[MAX_INTERACTIVE_TICKETS];
+static unsigned long lastInteractiveMs = 0;
+// Bytes served per class since interactive work last became active
+static uint64_t interactiveBytes = 0;
+static uint64_t bulkBytes = 0;
+
+// Upload connections with TCP ACKs held back; only touched on the AsyncTCP task
+struct DeferredUpload {
+    AsyncClient *client;
+    size_t pending;
+};
+static std::vector<DeferredUpload> deferredUploads;
+
+static bool interactiveActiveLocked(unsigned long now) {
+    for (int i = 0; i < MAX_INTERACTIVE_TICKETS; i++) {
+        if (ticketUsed[i] && now - ticketStartMs[i] < IO_INTERACTIVE_MAX_MS) return true;
+    }
+    return now - lastInteractiveMs < IO_INTERACTIVE_HOLD_MS;
+}
+
+// Returns the ticket to pass to ioEndInteractive(), or -1 if every slot is taken;
+// such work is then only covered by the hold window.
+int ioBeginInteractive() {
+    unsigned long now = millis();
+    int ticket = -1;
+
+    portENTER_CRITICAL(&ioMux);
+    if (!interactiveActiveLocked(now)) {
+        interactiveBytes = 0;
+        bulkBytes = 0;
+    }
+    for (int i = 0; i < MAX_INTERACTIVE_TICKETS; i++) {
+        if (!ticketUsed[i]) {
+            ticketUsed[i] = true;
+            ticketStartMs[i] = now;
+            ticket = i;
+            break;
+        }
+    }
+    lastInteractiveMs = now;
+    portEXIT_CRITICAL(&ioMux);
+
+    return ticket;
+}
+
+void ioEndInteractive(int ticket) {
+    unsigned long now = millis();
+
+    portENTER_CRITICAL(&ioMux);
+    bool expired = false;
+    if (ticket >= 0 && ticket < MAX_INTERACTIVE_TICKETS && ticketUsed[ticket]) {
+        ticketUsed[ticket] = false;
+        expired = now - ticketStartMs[ticket] >= IO_INTERACTIVE_MAX_MS;
+    }
+    // Work that outlived its limit does not get a hold window on top
+    if (!expired) lastInteractiveMs = now;
+    portEXIT_CRITICAL(&ioMux);
+}
+
+bool ioInteractiveActive() {
+    unsigned long now = millis();
+    portENTER_CRITICAL(&ioMux);
+    bool active = interactiveActiveLocked(now);
+    portEXIT_CRITICAL(&ioMux);
+    return active;
+}
+
+void ioWaitForIdle() {
+    while (ioInteractiveActive()) {
+        vTaskDelay(pdMS_TO_TICKS(20));
+    }
+}
+
+size_t ioBulkSlice(size_t maxLen) {
+    size_t slice = min(maxLen, (size_t)IO_BULK_SLICE_BYTES);
+    unsigned long now = millis();
+
+    portENTER_CRITICAL(&ioMux);
+    if (interactiveActiveLocked(now) && IO_BULK_SHARE_PERCENT < 100) {
+        // Bulk may use IO_BULK_SHARE_PERCENT of the bytes moved while interactive
+        // work is active. Past that it still gets a trickle so its ACK clock keeps running.
+        uint64_t budget = interactiveBytes * IO_BULK_SHARE_PERCENT / (100 - IO_BULK_SHARE_PERCENT);
+        uint64_t remaining = budget > bulkBytes ? budget - bulkBytes : 0;
+        size_t trickle = min(slice, (size_t)IO_BULK_TRICKLE_BYTES);
+        slice = remaining > trickle ? min(slice, (size_t)remaining) : trickle;
+    }
+    portEXIT_CRITICAL(&ioMux);
+
+    return slice;
+}
+
+void ioAccount(IoClass ioClass, size_t bytes) {
+    portENTER_CRITICAL(&ioMux);
+    if (ioClass == IO_INTERACTIVE) {
+        interactiveBytes += bytes;
+    } else {
+        bulkBytes += bytes;
+    }
+    portEXIT_CRITICAL(&ioMux);
+}
+
+static std::vector<DeferredUpload>::iterator findDeferred(AsyncClient *client) {
+    return std::find_if(deferredUploads.begin(), deferredUploads.end(),
+                        [client](const DeferredUpload& upload) { return upload.client == client; });
+}
+
+// Called from upload body callbacks with the bytes just received. While interactive
+// work is active, ACKs are paced by the same budget ioBulkSlice() applies to
+// downloads, with the trickle as a floor. At most IO_UPLOAD_MAX_DEFER_BYTES stay
+// unacknowledged, so the sender's window never closes completely: packets keep
+// arriving and each one clocks the next grant, without needing a timer.
+void ioThrottleUpload(AsyncClient *client, size_t len) {
+    if (!client) return;
+    if (!ioInteractiveActive()) {
+        ioResumeUpload(client);
+        return;
+    }
+
+    static const size_t maxDefer = min((size_t)IO_UPLOAD_MAX_DEFER_BYTES, (size_t)TCP_WND / 2);
+    auto it = findDeferred(client);
+    if (it == deferredUploads.end()) {
+        deferredUploads.push_back({client, 0});
+        it = deferredUploads.end() - 1;
+    }
+    DeferredUpload &upload = *it;
+
+    // Only earlier packets can be acknowledged here; this one is counted after the callback
+    size_t grant = ioBulkSlice(upload.pending);
+    if (upload.pending + len > maxDefer) {
+        grant = max(grant, min(upload.pending, upload.pending + len - maxDefer));
+    }
+    if (grant > 0) {
+        size_t acked = client->ack(grant);
+        // Fewer bytes held than estimated (e.g. multipart framing): start counting afresh
+        upload.pending = acked < grant ? 0 : upload.pending - acked;
+        ioAccount(IO_BULK, acked);
+    }
+
+    if (upload.pending + len > maxDefer) {
+        ioAccount(IO_BULK, len);
+        return;
+    }
+    client->ackLater();
+    upload.pending += len;
+}
+
+void ioResumeUpload(AsyncClient *client) {
+    auto it = findDeferred(client);
+    if (it == deferredUploads.end()) return;
+    deferredUploads.erase(it);
+    client->ack(SIZE_MAX);
+}
+
+void ioForgetUpload(AsyncClient *client) {
+    auto it = findDeferred(client);
+    if (it != deferredUploads.end()) deferredUploads.erase(it);
+}
@@ -0,0 +1,44 @@
+#ifndef IO_SCHEDULER_H
+#define IO_SCHEDULER_H
+
+#include <Arduino.h>
+
+class AsyncClient;
+
+enum IoClass {
+    IO_INTERACTIVE,
+    IO_BULK
+};
+
+int ioBeginInteractive();
+void ioEndInteractive(int ticket);
+bool ioInteractiveActive();
+void ioWaitForIdle();
+size_t ioBulkSlice(size_t maxLen);
+void ioAccount(IoClass ioClass, size_t bytes);
+void ioThrottleUpload(AsyncClient *client, size_t len);
+void ioResumeUpload(AsyncClient *client);
+void ioForgetUpload(AsyncClient *client);
+
+// Marks interactive work as in flight for as long as it lives, or until release(),
+// but for no longer than IO_INTERACTIVE_MAX_MS.
+class InteractiveIo {
+public:
+    InteractiveIo() : ticket(ioBeginInteractive()) {}
+    ~InteractiveIo() { release(); }
+    InteractiveIo(const InteractiveIo&) = delete;
+    InteractiveIo& operator=(const InteractiveIo&) = delete;
+
+    void release() {
+        if (active) {
+            active = false;
+            ioEndInteractive(ticket);
+        }
+    }
+
+private:
+    int ticket;
+    bool active = true;
+};
+
+#endif
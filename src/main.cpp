@@ -2,6 +2,7 @@
 #include <LittleFS.h>
 #include "config.h"
 #include "sd_card_manager.h"
+#include "dir_usage.h"
 #include "web_server.h"
 
 void setup() {
@@ -9,6 +10,7 @@ void setup() {
     LittleFS.begin();
     delay(2000);
     initSDCard();
+    startDirUsageScan();
     initAP();
     setupWebServer();
 }
@@ -2,11 +2,17 @@
 #include <ESPAsyncWebServer.h>
 #include <WiFi.h>
 #include <LittleFS.h>
+#include <MD5Builder.h>
+#include <base64.h>
 
 #include "web_server.h"
 #include "config.h"
 #include "file_utils.h"
 #include "web_utils.h"
+#include "dir_usage.h"
+#include "io_scheduler.h"
+#include <memory>
+#include <set>
 
 AsyncWebServer server(SERVER_PORT);
 
@@ -35,6 +41,7 @@ void setupWebServer() {
 
     server.on("/list", HTTP_GET, handleListFiles);
     server.on("/sdinfo", HTTP_GET, handleSDInfo);
+    server.on("/du", HTTP_GET, handleDirUsage);
     server.on("/download", HTTP_GET, handleDownload);
     server.on("/move", HTTP_GET, handleMove);
     server.on("/deleteFile", HTTP_GET, handleDeleteFile);
@@ -45,6 +52,7 @@ void setupWebServer() {
     server.on("/upload", HTTP_POST,
               [](AsyncWebServerRequest *request) { request->send(200); },
               handleUpload);
+    server.on("/files/*", HTTP_PUT, handlePutRequest, nullptr, handlePutBody);
 
     server.begin();
     Serial.println("Web server started");
@@ -78,7 +86,18 @@ void handleDeleteFile(AsyncWebServerRequest *request) {
         return;
     }
 
-    if (SD.remove(filepath)) {
+    dirUsageBeginWrite();
+    File existing = SD.open(filepath);
+    size_t removedSize = existing ? existing.size() : 0;
+    if (existing) existing.close();
+
+    bool removed = SD.remove(filepath);
+    if (removed) {
+        dirUsageApplyFile(filepath, -(int64_t)removedSize, -1);
+    }
+    dirUsageEndWrite();
+
+    if (removed) {
         request->send(200, "text/plain", "File deleted: " + filename);
         Serial.printf("File deleted: %s\n", filename.c_str());
     } else {
@@ -126,7 +145,17 @@ void handleDeleteFolder(AsyncWebServerRequest *request) {
     }
     dir.close();
 
-    if (deleteFolderRecursive(fullPath)) {
+    dirUsageBeginWrite();
+    bool deleted = deleteFolderRecursive(fullPath);
+    if (deleted) {
+        dirUsageRemoveFolder(fullPath);
+    } else {
+        // Part of the tree may already be gone, rebuild the index from disk
+        startDirUsageScan();
+    }
+    dirUsageEndWrite();
+
+    if (deleted) {
         request->send(200, "text/plain", "Folder deleted: " + folderName);
         Serial.printf("Folder deleted: %s\n", fullPath.c_str());
     } else {
@@ -157,7 +186,14 @@ void handleCreateFolder(AsyncWebServerRequest *request) {
 
     String fullPath = currentPath + folderName;
 
-    if (SD.mkdir(fullPath)) {
+    dirUsageBeginWrite();
+    bool created = SD.mkdir(fullPath);
+    if (created) {
+        dirUsageAddFolder(fullPath);
+    }
+    dirUsageEndWrite();
+
+    if (created) {
         request->send(200, "text/plain", "Folder created: " + folderName);
         Serial.printf("Folder created: %s\n", fullPath.c_str());
     } else {
@@ -166,11 +202,14 @@ void handleCreateFolder(AsyncWebServerRequest *request) {
 }
 
 void handleListFiles(AsyncWebServerRequest *request) {
+    InteractiveIo io;
     String path = "/";
     if (request->hasParam("path")) {
         path = request->getParam("path")->value();
     }
-    request->send(200, "text/html", getFileListHTML(path));
+    String html = getFileListHTML(path);
+    ioAccount(IO_INTERACTIVE, html.length());
+    request->send(200, "text/html", html);
 }
 
 void handleUpload(AsyncWebServerRequest *request,
@@ -182,8 +221,30 @@ void handleUpload(AsyncWebServerRequest *request,
     static File uploadFile;
     static String currentPath;
     static String currentFilename;
+    static size_t replacedSize;
+    static bool replacedExisting;
+    static AsyncWebServerRequest *uploadOwner = nullptr;
 
     if (!index) {
+        if (!uploadOwner) dirUsageBeginWrite();
+        uploadOwner = request;
+        AsyncClient *client = request->client();
+        // A dropped upload leaves a truncated file behind; account for what was written
+        request->onDisconnect([request, client]() {
+            ioForgetUpload(client);
+            if (uploadOwner != request) return;
+            uploadOwner = nullptr;
+            if (uploadFile) uploadFile.close();
+            File partial = SD.open(currentPath + currentFilename);
+            if (partial && !partial.isDirectory()) {
+                dirUsageApplyFile(currentPath + currentFilename,
+                                  (int64_t)partial.size() - (int64_t)replacedSize,
+                                  replacedExisting ? 0 : 1);
+            }
+            if (partial) partial.close();
+            dirUsageEndWrite();
+        });
+
         currentPath = "/";
         currentFilename = filename;
 
@@ -207,6 +268,11 @@ void handleUpload(AsyncWebServerRequest *request,
         String filepath = currentPath + currentFilename;
         Serial.printf("Upload start to: %s, full path: %s\n", currentPath.c_str(), filepath.c_str());
 
+        File existing = SD.open(filepath);
+        replacedExisting = existing && !existing.isDirectory();
+        replacedSize = replacedExisting ? existing.size() : 0;
+        if (existing) existing.close();
+
         uploadFile = SD.open(filepath, FILE_WRITE);
         if (!uploadFile) {
             Serial.println("Failed to open file for writing");
@@ -217,11 +283,344 @@ void handleUpload(AsyncWebServerRequest *request,
         uploadFile.write(data, len);
     }
 
+    if (final) {
+        ioResumeUpload(request->client());
+    } else {
+        ioThrottleUpload(request->client(), len);
+    }
+
     if (final && uploadFile) {
         uploadFile.close();
         size_t totalSize = index + len;
+        dirUsageApplyFile(currentPath + currentFilename,
+                          (int64_t)totalSize - (int64_t)replacedSize,
+                          replacedExisting ? 0 : 1);
         Serial.printf("Upload complete: %s, Size: %d bytes\n", currentFilename.c_str(), totalSize);
     }
+
+    if (final && uploadOwner == request) {
+        uploadOwner = nullptr;
+        dirUsageEndWrite();
+    }
+}
+
+// State of one raw-body PUT, kept in request->_tempObject while the body streams in.
+struct PutUpload {
+    File file;
+    String path;
+    String tempPath;
+    String asidePath;
+    String filename;
+    bool replacedExisting = false;
+    size_t replacedSize = 0;
+    size_t written = 0;
+    uint8_t *buffer = nullptr;
+    size_t buffered = 0;
+    bool writeOpen = false;
+    bool ownsTarget = false;
+    bool checkMd5 = false;
+    MD5Builder md5;
+    int errorCode = 0;
+    String error;
+    bool rejected = false;
+    size_t rejectSpace = 0;
+};
+
+// Targets with a PUT in progress, lower-cased since FAT names are case-insensitive
+static std::set<String> putTargets;
+// Seeded randomly so names do not repeat across reboots; temp names must keep
+// the ".<name>.<seq>.part|.old" shape the usage scan recognises
+static uint32_t putSequence = esp_random();
+
+static void failPutUpload(PutUpload *upload, int code, const String &error) {
+    if (upload->errorCode) return;
+    upload->errorCode = code;
+    upload->error = error;
+    Serial.printf("PUT upload failed: %s (%s)\n", upload->path.c_str(), error.c_str());
+}
+
+static void flushPutUpload(PutUpload *upload) {
+    if (upload->errorCode || upload->buffered == 0) return;
+    if (upload->file.write(upload->buffer, upload->buffered) != upload->buffered) {
+        failPutUpload(upload, 500, "Failed to write file");
+    }
+    upload->buffered = 0;
+}
+
+// Frees the file, temp name, write gate and target claim; safe to call twice.
+static void closePutUpload(PutUpload *upload, bool removeTemp) {
+    if (upload->file) upload->file.close();
+    if (removeTemp && SD.exists(upload->tempPath)) SD.remove(upload->tempPath);
+    if (upload->writeOpen) {
+        upload->writeOpen = false;
+        dirUsageEndWrite();
+    }
+    if (upload->ownsTarget) {
+        upload->ownsTarget = false;
+        String key = upload->path;
+        key.toLowerCase();
+        putTargets.erase(key);
+    }
+}
+
+static void releasePutUpload(AsyncWebServerRequest *request, bool removeTemp) {
+    PutUpload *upload = (PutUpload *)request->_tempObject;
+    if (!upload) return;
+    request->_tempObject = nullptr;
+    closePutUpload(upload, removeTemp);
+    free(upload->buffer);
+    delete upload;
+}
+
+static const char *putStatusText(int code) {
+    switch (code) {
+        case 400: return "Bad Request";
+        case 409: return "Conflict";
+        case 507: return "Insufficient Storage";
+        default: return "Internal Server Error";
+    }
+}
+
+// Answers a failed PUT while its body is still arriving. request->send() would
+// only go out once the whole body is read, so the response is written to the
+// socket directly and the rest of the body is dropped until the connection
+// is aborted (see handlePutBody).
+static void rejectPutUpload(AsyncWebServerRequest *request, PutUpload *upload) {
+    AsyncClient *client = request->client();
+    closePutUpload(upload, true);
+    ioResumeUpload(client);
+
+    String response = "HTTP/1.1 " + String(upload->errorCode) + " " + putStatusText(upload->errorCode) +
+                      "\r\nContent-Type: text/plain\r\nContent-Length: " + String(upload->error.length()) +
+                      "\r\nConnection: close\r\n\r\n" + upload->error;
+    upload->rejectSpace = client->space();
+    client->write(response.c_str(), response.length());
+    upload->rejected = true;
+}
+
+static PutUpload *beginPutUpload(AsyncWebServerRequest *request, size_t total) {
+    PutUpload *upload = new PutUpload();
+    request->_tempObject = upload;
+    AsyncClient *client = request->client();
+    request->onDisconnect([request, client]() {
+        ioForgetUpload(client);
+        releasePutUpload(request, true);
+    });
+
+    String path = sanitizePath(request->url().substring(strlen("/files")));
+    int lastSlash = path.lastIndexOf('/');
+    String dir = path.substring(0, lastSlash);
+    upload->filename = sanitizeFilename(path.substring(lastSlash + 1));
+    upload->path = dir + "/" + upload->filename;
+    // Unique per request so a concurrent or failed PUT never touches another one's files
+    String hidden = dir + "/." + upload->filename + "." + String(++putSequence);
+    upload->tempPath = hidden + ".part";
+    upload->asidePath = hidden + ".old";
+
+    if (upload->filename.length() == 0) {
+        failPutUpload(upload, 400, "Missing file name");
+        return upload;
+    }
+
+    String key = upload->path;
+    key.toLowerCase();
+    if (!putTargets.insert(key).second) {
+        failPutUpload(upload, 409, "Another upload to this file is in progress");
+        return upload;
+    }
+    upload->ownsTarget = true;
+
+    File existing = SD.open(upload->path);
+    if (existing && existing.isDirectory()) {
+        existing.close();
+        failPutUpload(upload, 409, "Path is a folder");
+        return upload;
+    }
+    upload->replacedExisting = (bool)existing;
+    upload->replacedSize = existing ? existing.size() : 0;
+    if (existing) existing.close();
+
+    // The old file stays in place until the new one is complete
+    uint64_t freeBytes = SD.totalBytes() - SD.usedBytes();
+    if (total > freeBytes) {
+        failPutUpload(upload, 507, "Not enough free space");
+        return upload;
+    }
+
+    if (request->hasHeader("Content-MD5") || request->hasHeader("Digest")) {
+        upload->checkMd5 = true;
+        upload->md5.begin();
+    }
+
+    upload->buffer = (uint8_t *)malloc(UPLOAD_BUFFER_SIZE);
+    if (!upload->buffer) {
+        failPutUpload(upload, 500, "Out of memory");
+        return upload;
+    }
+
+    upload->writeOpen = true;
+    dirUsageBeginWrite();
+    createPath(dir + "/");
+    upload->file = SD.open(upload->tempPath, FILE_WRITE);
+    if (!upload->file) {
+        failPutUpload(upload, 500, "Failed to open file for writing");
+    }
+
+    Serial.printf("PUT upload start: %s, %u bytes\n", upload->path.c_str(), (unsigned)total);
+    return upload;
+}
+
+// Accepts RFC 1864 Content-MD5 (base64, or hex for convenience) and RFC 3230 "Digest: md5=...".
+static bool putDigestMatches(AsyncWebServerRequest *request, PutUpload *upload) {
+    String expected;
+    if (request->hasHeader("Content-MD5")) {
+        expected = request->getHeader("Content-MD5")->value();
+    } else {
+        String digest = request->getHeader("Digest")->value();
+        String lower = digest;
+        lower.toLowerCase();
+        int start = lower.indexOf("md5=");
+        if (start < 0) return true;
+        int end = digest.indexOf(',', start);
+        expected = digest.substring(start + 4, end < 0 ? digest.length() : end);
+    }
+    expected.trim();
+
+    upload->md5.calculate();
+    if (expected.length() == 32) {
+        return expected.equalsIgnoreCase(upload->md5.toString());
+    }
+    uint8_t raw[16];
+    upload->md5.getBytes(raw);
+    return expected == base64::encode(raw, sizeof(raw));
+}
+
+void handlePutBody(AsyncWebServerRequest *request,
+                   uint8_t *data,
+                   size_t len,
+                   size_t index,
+                   size_t total) {
+    PutUpload *upload = (PutUpload *)request->_tempObject;
+    if (!index && !upload) {
+        upload = beginPutUpload(request, total);
+    }
+
+    if (upload && upload->rejected) {
+        // Abort only once the peer has acknowledged the response, so the
+        // reset cannot overtake it
+        if (request->client()->space() >= upload->rejectSpace) request->abort();
+        return;
+    }
+    if (upload && upload->errorCode) {
+        if (index + len < total) {
+            rejectPutUpload(request, upload);
+        } else {
+            ioResumeUpload(request->client());
+        }
+        return;
+    }
+
+    if (index + len >= total) {
+        ioResumeUpload(request->client());
+    } else if (upload) {
+        ioThrottleUpload(request->client(), len);
+    }
+    if (!upload) return;
+
+    if (upload->checkMd5) {
+        upload->md5.add(data, len);
+    }
+
+    // Smaller SD writes while interactive requests wait for the card
+    size_t flushAt = ioInteractiveActive() ? IO_BULK_SLICE_BYTES : UPLOAD_BUFFER_SIZE;
+    while (len > 0) {
+        size_t chunk = min(len, (size_t)UPLOAD_BUFFER_SIZE - upload->buffered);
+        memcpy(upload->buffer + upload->buffered, data, chunk);
+        upload->buffered += chunk;
+        upload->written += chunk;
+        data += chunk;
+        len -= chunk;
+        if (upload->buffered >= flushAt) {
+            flushPutUpload(upload);
+            if (upload->errorCode) {
+                if (upload->written < total) rejectPutUpload(request, upload);
+                return;
+            }
+        }
+    }
+}
+
+void handlePutRequest(AsyncWebServerRequest *request) {
+    if (!request->hasHeader("Content-Length")) {
+        request->send(411, "text/plain", "Content-Length required");
+        return;
+    }
+
+    PutUpload *upload = (PutUpload *)request->_tempObject;
+    if (!upload) {
+        if (request->contentLength() > 0) {
+            request->send(415, "text/plain", "Send the raw file as the request body");
+            return;
+        }
+        upload = beginPutUpload(request, 0);
+    }
+    if (upload->rejected) {
+        // The whole body arrived before the early response was acknowledged
+        releasePutUpload(request, true);
+        request->abort();
+        return;
+    }
+
+    flushPutUpload(upload);
+    if (!upload->errorCode && upload->written != request->contentLength()) {
+        failPutUpload(upload, 400, "Body length does not match Content-Length");
+    }
+    if (upload->file) upload->file.close();
+    if (!upload->errorCode && upload->checkMd5 && !putDigestMatches(request, upload)) {
+        failPutUpload(upload, 400, "Content-MD5 mismatch");
+    }
+
+    if (upload->errorCode) {
+        int code = upload->errorCode;
+        String error = upload->error;
+        releasePutUpload(request, true);
+        request->send(code, "text/plain", error);
+        return;
+    }
+
+    // Move the old file aside first so a failed rename can put it back
+    if (upload->replacedExisting && !SD.rename(upload->path, upload->asidePath)) {
+        releasePutUpload(request, true);
+        request->send(500, "text/plain", "Failed to replace file");
+        return;
+    }
+    if (!SD.rename(upload->tempPath, upload->path)) {
+        if (!upload->replacedExisting || SD.rename(upload->asidePath, upload->path)) {
+            releasePutUpload(request, true);
+        } else {
+            Serial.printf("PUT upload: kept %s and %s after failed replace\n",
+                          upload->tempPath.c_str(), upload->asidePath.c_str());
+            releasePutUpload(request, false);
+            // The rescan puts the aside copy back once the card allows it
+            startDirUsageScan();
+        }
+        request->send(500, "text/plain", "Failed to store file");
+        return;
+    }
+    if (upload->replacedExisting && !SD.remove(upload->asidePath)) {
+        Serial.printf("PUT upload: failed to remove replaced copy %s\n", upload->asidePath.c_str());
+    }
+
+    dirUsageApplyFile(upload->path,
+                      (int64_t)upload->written - (int64_t)upload->replacedSize,
+                      upload->replacedExisting ? 0 : 1);
+    Serial.printf("PUT upload complete: %s, Size: %u bytes\n",
+                  upload->path.c_str(), (unsigned)upload->written);
+
+    int code = upload->replacedExisting ? 200 : 201;
+    String message = "File uploaded: " + upload->filename;
+    releasePutUpload(request, false);
+    request->send(code, "text/plain", message);
 }
 
 void handleDownload(AsyncWebServerRequest *request) {
@@ -261,12 +660,19 @@ void handleDownload(AsyncWebServerRequest *request) {
         return;
     }
 
-    file.close();
+    size_t fileSize = file.size();
 
-    Serial.printf("Sending file: %s, bytes, Type: %s\n",
-                  filename.c_str(), contentType.c_str());
+    Serial.printf("Sending file: %s, %u bytes, Type: %s\n",
+                  filename.c_str(), (unsigned)fileSize, contentType.c_str());
 
-    AsyncWebServerResponse *response = request->beginResponse(SD, filepath, contentType);
+    // Bulk stream: each fill reads at most the slice the I/O scheduler grants
+    AsyncWebServerResponse *response = request->beginResponse(contentType, fileSize,
+        [file, fileSize](uint8_t *buffer, size_t maxLen, size_t index) mutable -> size_t {
+            size_t read = file.read(buffer, ioBulkSlice(maxLen));
+            ioAccount(IO_BULK, read);
+            if (index + read >= fileSize) file.close();
+            return read;
+        });
 
     response->addHeader("Content-Disposition", "attachment; filename=\"" + filename + "\"");
 
@@ -279,11 +685,44 @@ void handleDownload(AsyncWebServerRequest *request) {
 
 
 void handleSDInfo(AsyncWebServerRequest *request) {
+    InteractiveIo io;
     String info = getSDCardInfo();
     request->send(200, "text/plain", info);
 }
 
+void handleDirUsage(AsyncWebServerRequest *request) {
+    InteractiveIo io;
+    String path = "/";
+    if (request->hasParam("path")) {
+        path = request->getParam("path")->value();
+    }
+    path = sanitizePath(path);
+
+    if (!isDirUsageReady()) {
+        AsyncWebServerResponse *response = request->beginResponse(503, "text/plain", "Folder sizes are still being calculated");
+        response->addHeader("Retry-After", "5");
+        request->send(response);
+        return;
+    }
+
+    DirUsage usage;
+    if (!getDirUsage(path, usage)) {
+        request->send(404, "text/plain", "Folder not found");
+        return;
+    }
+
+    char json[160];
+    snprintf(json, sizeof(json),
+             "{\"bytes\":%llu,\"files\":%u,\"folders\":%u,\"size\":\"%s\"}",
+             usage.bytes, (unsigned)usage.files, (unsigned)usage.dirs, formatSize(usage.bytes).c_str());
+    request->send(200, "application/json", json);
+}
+
 void handleImagePreview(AsyncWebServerRequest *request) {
+    // Keeps bulk transfers throttled until the last byte is read, the response is
+    // dropped or IO_INTERACTIVE_MAX_MS passes
+    auto io = std::make_shared<InteractiveIo>();
+
     if (!request->hasParam("path")) {
         request->send(400, "text/plain", "Missing path parameter");
         return;
@@ -305,7 +744,23 @@ void handleImagePreview(AsyncWebServerRequest *request) {
 
     String contentType = getContentType(filename);
 
-    AsyncWebServerResponse *response = request->beginResponse(SD, filepath, contentType);
+    File file = SD.open(filepath, FILE_READ);
+    if (!file) {
+        request->send(500, "text/plain", "Failed to open image");
+        return;
+    }
+    size_t fileSize = file.size();
+
+    AsyncWebServerResponse *response = request->beginResponse(contentType, fileSize,
+        [file, fileSize, io](uint8_t *buffer, size_t maxLen, size_t index) mutable -> size_t {
+            size_t read = file.read(buffer, maxLen);
+            ioAccount(IO_INTERACTIVE, read);
+            if (index + read >= fileSize) {
+                file.close();
+                io->release();
+            }
+            return read;
+        });
 
     response->addHeader("Cache-Control", "public, max-age=86400");
     request->send(response);
@@ -349,6 +804,7 @@ void handleMove(AsyncWebServerRequest *request) {
     // Prevent moving a directory into its own subdirectory
     File s = SD.open(src);
     bool isDir = s && s.isDirectory();
+    size_t srcSize = (s && !isDir) ? s.size() : 0;
     if (s) s.close();
 
     if (isDir) {
@@ -377,7 +833,13 @@ void handleMove(AsyncWebServerRequest *request) {
         return;
     }
 
+    dirUsageBeginWrite();
     bool ok = SD.rename(src, newPath);
+    if (ok) {
+        dirUsageMove(src, newPath, isDir, srcSize);
+    }
+    dirUsageEndWrite();
+
     if (ok) {
         request->send(200, "text/plain", "Moved");
     } else {
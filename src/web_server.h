@@ -12,6 +12,9 @@ class AsyncWebServerRequest;
 #ifndef HTTP_POST
 #define HTTP_POST 0b00000010
 #endif
+#ifndef HTTP_PUT
+#define HTTP_PUT 0b00001000
+#endif
 
 extern AsyncWebServer server;
 
@@ -23,8 +26,15 @@ void handleUpload(AsyncWebServerRequest *request,
                   uint8_t *data,
                   size_t len,
                   bool final);
+void handlePutRequest(AsyncWebServerRequest *request);
+void handlePutBody(AsyncWebServerRequest *request,
+                   uint8_t *data,
+                   size_t len,
+                   size_t index,
+                   size_t total);
 void handleListFiles(AsyncWebServerRequest *request);
 void handleSDInfo(AsyncWebServerRequest *request);
+void handleDirUsage(AsyncWebServerRequest *request);
 void handleDownload(AsyncWebServerRequest *request);
 void handleMove(AsyncWebServerRequest *request);
 void handleDeleteFile(AsyncWebServerRequest *request);
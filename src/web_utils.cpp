@@ -3,6 +3,7 @@ using namespace std;
 #include "web_utils.h"
 #include "SD.h"
 #include "file_utils.h"
+#include "dir_usage.h"
 #include <map>
 #include <vector>
 #include <algorithm>
@@ -16,6 +17,23 @@ String getSDCardInfo() {
     return String(buffer);
 }
 
+String formatSize(uint64_t bytes) {
+    static const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    double value = bytes;
+    int unit = 0;
+    while (value >= 1024.0 && unit < 4) {
+        value /= 1024.0;
+        unit++;
+    }
+    char buffer[24];
+    if (unit == 0) {
+        snprintf(buffer, sizeof(buffer), "%llu B", bytes);
+    } else {
+        snprintf(buffer, sizeof(buffer), "%.1f %s", value, units[unit]);
+    }
+    return String(buffer);
+}
+
 String getContentType(String filename) {
     filename.toLowerCase();
 
@@ -110,6 +128,10 @@ String getFileListHTML(String currentPath) {
         html += "<button class='file-card' onclick=\"navigateToFolder('" + currentPath + "/" + filename + "')\">";
         html += "<img src='/icons/folder.png' class='file-icon-img' alt='Folder'>";
         html += "<span class='file-name'>" + filename + "</span>";
+        DirUsage usage;
+        if (getDirUsage(currentPath + "/" + filename, usage)) {
+            html += "<span class='file-size'>" + formatSize(usage.bytes) + " &middot; " + String(usage.files) + " files</span>";
+        }
         html += "</button>";
         html += "</div>";
     }
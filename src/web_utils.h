@@ -6,5 +6,6 @@
 String getContentType(String filename);
 String getFileListHTML(String currentPath = "/");
 String getSDCardInfo();
+String formatSize(uint64_t bytes);
 
 #endif
\ No newline at end of file
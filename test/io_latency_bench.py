@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""Interactive latency under a saturating transfer.
+
+Times repeated /list and /preview requests against a running LocalCloud,
+first on an idle device and then while a background thread keeps a large
+/download (or PUT /files upload) running, and prints p50/p95/p99 for each.
+
+Examples:
+    python3 test/io_latency_bench.py --download /videos/big.mp4 --preview /photos/a.jpg
+    python3 test/io_latency_bench.py --upload big.bin --preview /photos/a.jpg
+
+Uses only the Python standard library.
+"""
+
+import argparse
+import http.client
+import os
+import statistics
+import threading
+import time
+import urllib.parse
+
+CHUNK = 64 * 1024
+
+
+def percentile(samples, pct):
+    ordered = sorted(samples)
+    if not ordered:
+        return float("nan")
+    k = (len(ordered) - 1) * pct / 100.0
+    lo = int(k)
+    hi = min(lo + 1, len(ordered) - 1)
+    return ordered[lo] + (ordered[hi] - ordered[lo]) * (k - lo)
+
+
+def timed_get(host, port, url, timeout):
+    start = time.perf_counter()
+    conn = http.client.HTTPConnection(host, port, timeout=timeout)
+    try:
+        conn.request("GET", url)
+        resp = conn.getresponse()
+        resp.read()
+        if resp.status != 200:
+            raise RuntimeError(f"{url}: HTTP {resp.status}")
+    finally:
+        conn.close()
+    return (time.perf_counter() - start) * 1000.0
+
+
+def download_loop(args, stop, moved):
+    folder, name = os.path.split(args.download)
+    url = "/download?" + urllib.parse.urlencode({"path": folder or "/", "file": name})
+    while not stop.is_set():
+        conn = http.client.HTTPConnection(args.host, args.port, timeout=args.timeout)
+        try:
+            conn.request("GET", url)
+            resp = conn.getresponse()
+            while not stop.is_set():
+                data = resp.read(CHUNK)
+                if not data:
+                    break
+                moved[0] += len(data)
+        except OSError:
+            time.sleep(0.5)
+        finally:
+            conn.close()
+
+
+def upload_loop(args, stop, moved):
+    size = os.path.getsize(args.upload)
+    path = args.upload_to if args.upload_to.startswith("/") else "/" + args.upload_to
+    target = "/files" + urllib.parse.quote(path)
+    while not stop.is_set():
+        conn = http.client.HTTPConnection(args.host, args.port, timeout=args.timeout)
+        try:
+            conn.putrequest("PUT", target)
+            conn.putheader("Content-Type", "application/octet-stream")
+            conn.putheader("Content-Length", str(size))
+            conn.endheaders()
+            with open(args.upload, "rb") as f:
+                while not stop.is_set():
+                    data = f.read(CHUNK)
+                    if not data:
+                        break
+                    conn.send(data)
+                    moved[0] += len(data)
+            if not stop.is_set():
+                conn.getresponse().read()
+        except OSError:
+            time.sleep(0.5)
+        finally:
+            conn.close()
+
+
+def measure(args, label):
+    urls = {"list": "/list?" + urllib.parse.urlencode({"path": args.list_path})}
+    if args.preview:
+        urls["preview"] = "/preview?" + urllib.parse.urlencode({"path": args.preview})
+
+    results = {}
+    for name, url in urls.items():
+        samples = []
+        for _ in range(args.count):
+            samples.append(timed_get(args.host, args.port, url, args.timeout))
+            time.sleep(args.interval)
+        results[name] = samples
+
+    for name, samples in results.items():
+        print(f"{label:<12} {name:<8} n={len(samples):<4} "
+              f"p50={percentile(samples, 50):8.1f} ms  "
+              f"p95={percentile(samples, 95):8.1f} ms  "
+              f"p99={percentile(samples, 99):8.1f} ms  "
+              f"max={max(samples):8.1f} ms  "
+              f"mean={statistics.mean(samples):8.1f} ms")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", default="192.168.100.1")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--list-path", default="/", help="folder passed to /list")
+    parser.add_argument("--preview", help="image path passed to /preview")
+    parser.add_argument("--download", help="large file on the card to stream in the background")
+    parser.add_argument("--upload", help="large local file to PUT in the background")
+    parser.add_argument("--upload-to", default="/bench/upload.bin", help="target of the background PUT")
+    parser.add_argument("--count", type=int, default=200, help="samples per endpoint and phase")
+    parser.add_argument("--interval", type=float, default=0.05, help="pause between samples in seconds")
+    parser.add_argument("--warmup", type=float, default=3.0, help="seconds to let the transfer ramp up")
+    parser.add_argument("--timeout", type=float, default=30.0)
+    args = parser.parse_args()
+
+    if bool(args.download) == bool(args.upload):
+        parser.error("pass exactly one of --download or --upload")
+
+    measure(args, "idle")
+
+    stop = threading.Event()
+    moved = [0]
+    loop = download_loop if args.download else upload_loop
+    worker = threading.Thread(target=loop, args=(args, stop, moved), daemon=True)
+    worker.start()
+    time.sleep(args.warmup)
+
+    started = time.perf_counter()
+    start_bytes = moved[0]
+    measure(args, "saturated")
+    elapsed = time.perf_counter() - started
+    stop.set()
+    worker.join(timeout=args.timeout)
+
+    rate = (moved[0] - start_bytes) / elapsed / (1024 * 1024)
+    print(f"background {'download' if args.download else 'upload'}: {rate:.2f} MB/s while measuring")
+
+
+if __name__ == "__main__":
+    main()